@@ -30,4 +30,101 @@ cat dir3/ccc
 
 cd ..
 fusermount -u fs
-rm -rf fs
\ No newline at end of file
+rm -rf fs
+# tiering test: write well past the memory budget, read back and compare
+
+failed=0
+check() {
+    if [ "$(sha256sum < $1)" = "$(sha256sum < fs/$1)" ]; then
+        echo "$1: ok"
+    else
+        echo "$1: checksum mismatch"
+        failed=1
+    fi
+}
+
+dd if=/dev/urandom of=random.dat bs=1M count=64
+mkdir fs
+./vtfs fs --mem-budget=16 --backing-file=vtfs.backing
+cp random.dat fs
+check random.dat
+# overwrite the middle of a spilled file
+dd if=/dev/urandom of=random.dat bs=1M count=4 seek=20 conv=notrunc
+dd if=random.dat of=fs/random.dat bs=1M count=4 skip=20 seek=20 conv=notrunc
+check random.dat
+fusermount -u fs
+rm -rf fs random.dat vtfs.backing
+
+# compaction test: two 12 MB files written in turn are fragmented, a pass must finish and move them
+
+mkdir fs
+./vtfs fs --compact-interval=100
+exec 3>fs/a 4>fs/b
+i=0
+while [ $i -lt 3072 ]; do
+    head -c 4096 /dev/urandom >&3
+    head -c 4096 /dev/urandom >&4
+    i=$((i + 1))
+done
+exec 3>&- 4>&-
+sleep 3
+getfattr --only-values -n user.vtfs.stats fs | tee stats.txt
+grep -q " 0 blocks moved" stats.txt && failed=1
+fusermount -u fs
+rm -rf fs stats.txt
+
+# compression test: compressible data is compressed in the background and reads back intact
+
+yes helloworld | head -c 33554432 > text.dat
+mkdir fs
+./vtfs fs --compress-after=1
+cp text.dat fs
+sleep 3
+getfattr --only-values -n user.vtfs.stats fs | tee stats.txt
+grep -q " 0 compressed" stats.txt && failed=1
+check text.dat
+# a write decompresses a block back to a page
+dd if=/dev/urandom of=text.dat bs=4096 count=16 seek=1000 conv=notrunc
+dd if=text.dat of=fs/text.dat bs=4096 count=16 skip=1000 seek=1000 conv=notrunc
+check text.dat
+fusermount -u fs
+rm -rf fs text.dat stats.txt
+
+# trace replay test: operations traced on a mount replay with the same return values
+
+mkdir fs
+./vtfs fs --trace=vtfs.trace
+mkdir fs/dir1 fs/dir2
+echo helloworld > fs/dir1/testfile
+dd if=/dev/urandom of=fs/dir2/random bs=1M count=8
+cat fs/dir1/testfile
+dd if=fs/dir2/random of=/dev/null
+ls -al fs/dir1 fs/dir2
+rm fs/dir1/testfile
+rmdir fs/dir1
+fusermount -u fs
+rm -rf fs
+./vtfs --replay=vtfs.trace --replay-fast 2>&1 > /dev/null | tee replay.log
+grep -q " 0 return value mismatch" replay.log || failed=1
+rm -f vtfs.trace replay.log
+
+# unlink while open test: a removed file can be read through the handle opened before
+
+dd if=/dev/urandom of=open.dat bs=1M count=4
+mkdir fs
+./vtfs fs
+cp open.dat fs
+exec 5<fs/open.dat
+rm fs/open.dat
+ls -a fs | grep -q "open.dat\|fuse_hidden" && failed=1
+if [ "$(sha256sum <&5)" = "$(sha256sum < open.dat)" ]; then
+    echo "open.dat: ok"
+else
+    echo "open.dat: checksum mismatch"
+    failed=1
+fi
+exec 5<&-
+fusermount -u fs
+rm -rf fs open.dat
+
+exit $failed
@@ -3,13 +3,23 @@
  * Basic file and directory operations on dynamically allocated memory.
  */
 #include <cstdio>
+#include <map>
+#include <set>
 #include <vector>
+#include <deque>
 #include <string>
 #include <cstring>
+#include <cstdlib>
 #include <algorithm>
 
 #include <fuse.h>
+#include <time.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 using namespace std;
@@ -32,7 +42,7 @@ const size_t IDX_PER_PAGE = PAGESIZE / sizeof(BLKID_T);
 const size_t SPC_PER_PAGE = (IDX_PER_PAGE - 1) * (PAGESIZE);
 /*
  * Everything is based on one (or more) block(s).
- * A block is a mmap-ed page. 
+ * A block is a page in a mmap-ed arena chunk, see arena functions.
  */
 const size_t MAX_BLK_ID = 1048576;
 
@@ -130,6 +140,30 @@ struct ContentNode
 
 /* helper functions */
 
+/*
+ * replaying is true when the engine is driven by the replay tool instead of FUSE.
+ */
+bool replaying = false;
+
+/*
+ * get_context
+ * fuse_get_context() is only valid inside a FUSE request,
+ * when replaying, a context of the current process is returned.
+ */
+struct fuse_context* get_context() {
+    static struct fuse_context replay_context;
+    if (!replaying) return fuse_get_context();
+    replay_context.uid = getuid();
+    replay_context.gid = getgid();
+    return &replay_context;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /*
  * get_default_stat
  * get a default `struct stat` for a file or dir.
@@ -139,52 +173,717 @@ struct stat get_default_stat(bool dir = false) {
     memset(&st, 0, sizeof(struct stat));
     if (!dir) st.st_mode = S_IFREG | 0755;
     else st.st_mode = S_IFDIR | 0755;
-    st.st_uid = fuse_get_context()->uid;
-    st.st_gid = fuse_get_context()->gid;
+    st.st_uid = get_context()->uid;
+    st.st_gid = get_context()->gid;
     st.st_nlink = 1;
     st.st_size = 0;
     return st;
 }
 
-/* block functions */
+/* arena functions */
 void* blk_ids[MAX_BLK_ID];
+
+/*
+ * Blocks are carved from chunks of CHUNK_PAGES pages instead of one mmap per block,
+ * so blocks allocated together are adjacent in memory, and the compactor
+ * can move a file into a contiguous run. A chunk is unmapped once it's empty.
+ */
+const size_t CHUNK_PAGES = 512;
+const size_t MAX_CHUNK = MAX_BLK_ID / CHUNK_PAGES * 2;
+
+/*
+ * Chunk
+ * attributes:
+ *   base: the mmap-ed memory, NULL if the chunk is not mapped;
+ *   used: the number of used slots;
+ *   next: where to look for a free slot next time;
+ *   reserved: the chunk is being filled by the compactor, map_blk skips it;
+ *   slot_used: whether a slot (a page) is used by a block.
+ */
+struct Chunk
+{
+    char* base;
+    size_t used;
+    size_t next;
+    bool reserved;
+    bool slot_used[CHUNK_PAGES];
+};
+
+Chunk chunks[MAX_CHUNK];
+unsigned int blk_chunk[MAX_BLK_ID]; // the chunk of a block
+size_t chunk_num = 0;               // the number of mapped chunks
+size_t alloc_chunk = 0;             // the chunk map_blk tries first
+
+/*
+ * map_chunk
+ * map an unused chunk, return its index or -1.
+ */
+long map_chunk() {
+    for (size_t c = 0; c < MAX_CHUNK; c++) {
+        if (chunks[c].base) continue;
+        void* base = mmap(NULL, CHUNK_PAGES * PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) return -1;
+        memset(&chunks[c], 0, sizeof(Chunk));
+        chunks[c].base = (char*)base;
+        chunk_num++;
+        return c;
+    }
+    return -1;
+}
+
+/*
+ * take_slot
+ * find a free slot in a chunk from chunk.next, return it or -1.
+ */
+long take_slot(size_t c) {
+    Chunk& chunk = chunks[c];
+    if (chunk.used == CHUNK_PAGES) return -1;
+    for (size_t n = 0; n < CHUNK_PAGES; n++) {
+        size_t slot = (chunk.next + n) % CHUNK_PAGES;
+        if (chunk.slot_used[slot]) continue;
+        chunk.slot_used[slot] = true;
+        chunk.used++;
+        chunk.next = slot + 1;
+        return slot;
+    }
+    return -1;
+}
+
+/*
+ * unmap_blk
+ * release the page of a block to the kernel, and the whole chunk if it's empty now.
+ */
+void unmap_blk(BLKID_T idx) {
+    size_t c = blk_chunk[idx];
+    Chunk& chunk = chunks[c];
+    char* page = (char*)blk_ids[idx];
+    chunk.slot_used[(page - chunk.base) / PAGESIZE] = false;
+    blk_ids[idx] = NULL;
+    if (--chunk.used == 0 and !chunk.reserved) {
+        munmap(chunk.base, CHUNK_PAGES * PAGESIZE);
+        chunk.base = NULL;
+        chunk_num--;
+    } else {
+        madvise(page, PAGESIZE, MADV_DONTNEED);
+    }
+}
+
+/*
+ * put_blk
+ * put a block into a slot, and move its content there if it already has memory.
+ */
+void put_blk(BLKID_T idx, size_t c, size_t slot) {
+    char* page = chunks[c].base + slot * PAGESIZE;
+    if (blk_ids[idx]) {
+        memcpy(page, blk_ids[idx], PAGESIZE);
+        unmap_blk(idx);
+    }
+    blk_ids[idx] = page;
+    blk_chunk[idx] = c;
+}
+
+/*
+ * map_blk
+ * give a block a page, blocks mapped one after another are adjacent if possible.
+ */
+bool map_blk(BLKID_T idx) {
+    for (size_t n = 0; n < MAX_CHUNK; n++) {
+        size_t c = (alloc_chunk + n) % MAX_CHUNK;
+        if (!chunks[c].base or chunks[c].reserved) continue;
+        long slot = take_slot(c);
+        if (slot == -1) continue;
+        alloc_chunk = c;
+        put_blk(idx, c, slot);
+        return true;
+    }
+    long c = map_chunk();
+    if (c == -1) return false;
+    alloc_chunk = c;
+    put_blk(idx, c, take_slot(c));
+    return true;
+}
+
+/* zip functions */
+
+/*
+ * Cold data blocks may be compressed (see compress functions).
+ * The codec below writes the LZ4 block format: a sequence is a token
+ * (literal length << 4 | match length - 4), extra length bytes, literals,
+ * a 2-byte little-endian offset and extra match length bytes.
+ * The last sequence has only literals, the last LZ_LAST_LITERALS bytes are always literals
+ * and no match starts in the last LZ_MF_LIMIT bytes.
+ */
+const size_t LZ_HASH_LOG = 12;
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_LAST_LITERALS = 5;
+const size_t LZ_MF_LIMIT = 12;
+
+uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+bool lz_put_len(unsigned char* dst, size_t& out, size_t cap, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (out >= cap) return false;
+        dst[out++] = 255;
+    }
+    if (out >= cap) return false;
+    dst[out++] = len;
+    return true;
+}
+
+/*
+ * lz_put_seq
+ * write a sequence: `lit` literals from `src`, then a match (if match_len != 0).
+ */
+bool lz_put_seq(unsigned char* dst, size_t& out, size_t cap, const unsigned char* src, size_t lit, size_t offset, size_t match_len) {
+    if (out >= cap) return false;
+    size_t token = out++;
+    dst[token] = min(lit, (size_t)15) << 4;
+    if (lit >= 15 and !lz_put_len(dst, out, cap, lit - 15)) return false;
+    if (out + lit > cap) return false;
+    memcpy(dst + out, src, lit);
+    out += lit;
+    if (match_len == 0) return true;
+    if (out + 2 > cap) return false;
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    dst[token] |= min(match_len, (size_t)15);
+    return match_len < 15 or lz_put_len(dst, out, cap, match_len - 15);
+}
+
+/*
+ * lz_compress
+ * compress n (<= 64K) bytes, return the compressed size, or 0 if it doesn't fit in cap.
+ */
+size_t lz_compress(const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+    uint16_t table[1 << LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+    size_t out = 0, anchor = 0;
+    for (size_t i = 1; n > LZ_MF_LIMIT and i < n - LZ_MF_LIMIT; ) {
+        uint32_t v, rv;
+        memcpy(&v, src + i, 4);
+        uint32_t h = lz_hash(v);
+        size_t ref = table[h];
+        table[h] = i;
+        memcpy(&rv, src + ref, 4);
+        if (rv != v) {
+            i++;
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < n - LZ_LAST_LITERALS and src[ref + len] == src[i + len]) len++;
+        if (!lz_put_seq(dst, out, cap, src + anchor, i - anchor, i - ref, len)) return 0;
+        i += len;
+        anchor = i;
+    }
+    if (!lz_put_seq(dst, out, cap, src + anchor, n - anchor, 0, 0)) return 0;
+    return out;
+}
+
+/*
+ * lz_decompress
+ * return true if src decompresses to exactly cap bytes.
+ */
+bool lz_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+    size_t i = 0, out = 0;
+    while (i < n) {
+        unsigned char token = src[i++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned char b;
+            do {
+                if (i >= n) return false;
+                b = src[i++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (i + lit > n or out + lit > cap) return false;
+        memcpy(dst + out, src + i, lit);
+        i += lit;
+        out += lit;
+        if (i == n) break;
+
+        if (i + 2 > n) return false;
+        size_t offset = src[i] | (src[i + 1] << 8);
+        i += 2;
+        size_t match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            unsigned char b;
+            do {
+                if (i >= n) return false;
+                b = src[i++];
+                match_len += b;
+            } while (b == 255);
+        }
+        if (offset == 0 or offset > out or out + match_len > cap) return false;
+        if (offset >= match_len) {
+            memcpy(dst + out, dst + out - offset, match_len);
+        } else {
+            for (size_t k = 0; k < match_len; k++) dst[out + k] = dst[out - offset + k];
+        }
+        out += match_len;
+    }
+    return out == cap;
+}
+
+/*
+ * Compressed blocks live in slabs of ZSLAB_SIZE bytes, cut into slots of one size class.
+ * Class k has slots of (k + 1) * ZCLASS_SIZE bytes. A block that doesn't compress
+ * into the largest class is not worth it and stays uncompressed.
+ * Slots are taken from the lowest slab of a class with free slots, so the others
+ * can empty out, and a slab is unmapped once it's empty.
+ */
+const size_t ZCLASS_SIZE = 256;
+const size_t ZCLASS_NUM = 12;
+const size_t ZSLAB_SIZE = 64 * 1024;
+
+/*
+ * ZSlab
+ * attributes:
+ *   cls: the size class of its slots;
+ *   used: the number of used slots;
+ *   free_slots: the free slots, the lowest last.
+ */
+struct ZSlab
+{
+    size_t cls;
+    size_t used;
+    vector<unsigned char*> free_slots;
+};
+
+map<unsigned char*, ZSlab> zslabs;        // all slabs by base address
+set<unsigned char*> zpartial[ZCLASS_NUM]; // slabs with free slots of every class
+size_t zslab_bytes = 0;
+
+unsigned char* zalloc(size_t len) {
+    size_t cls = (len - 1) / ZCLASS_SIZE;
+    if (zpartial[cls].empty()) {
+        void* base = mmap(NULL, ZSLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) return NULL;
+        ZSlab& slab = zslabs[(unsigned char*)base];
+        slab.cls = cls;
+        slab.used = 0;
+        size_t slot_size = (cls + 1) * ZCLASS_SIZE;
+        for (size_t off = ZSLAB_SIZE / slot_size * slot_size; off > 0; off -= slot_size)
+            slab.free_slots.push_back((unsigned char*)base + off - slot_size);
+        zpartial[cls].insert((unsigned char*)base);
+        zslab_bytes += ZSLAB_SIZE;
+    }
+    unsigned char* base = *zpartial[cls].begin();
+    ZSlab& slab = zslabs[base];
+    unsigned char* slot = slab.free_slots.back();
+    slab.free_slots.pop_back();
+    slab.used++;
+    if (slab.free_slots.empty()) zpartial[cls].erase(base);
+    return slot;
+}
+
+void zrelease(unsigned char* slot) {
+    map<unsigned char*, ZSlab>::iterator it = --zslabs.upper_bound(slot);
+    ZSlab& slab = it->second;
+    if (slab.free_slots.empty()) zpartial[slab.cls].insert(it->first);
+    slab.free_slots.push_back(slot);
+    if (--slab.used == 0) {
+        zpartial[slab.cls].erase(it->first);
+        munmap(it->first, ZSLAB_SIZE);
+        zslabs.erase(it);
+        zslab_bytes -= ZSLAB_SIZE;
+    }
+}
+
+/*
+ * ZCacheEntry keeps a decompressed copy of a compressed block for reads,
+ * the cache is direct-mapped by block id. A block decompressed ZIP_PROMOTE_UNZIPS times
+ * is decompressed back to a page on its next read.
+ */
+const size_t ZCACHE_SIZE = 64;
+const unsigned char ZIP_PROMOTE_UNZIPS = 4;
+
+struct ZCacheEntry
+{
+    BLKID_T idx; // -1 if empty
+    unsigned char data[PAGESIZE];
+};
+
+ZCacheEntry zcache[ZCACHE_SIZE];
+
+/*
+ * statistics of compression, CPU time is the time spent in the codec.
+ */
+size_t zip_blocks = 0, zip_bytes = 0; // compressed blocks now, and their compressed size
+size_t zip_count = 0, zip_rejects = 0, unzip_count = 0;
+size_t zcache_hits = 0, zcache_misses = 0;
+uint64_t zip_ns = 0, unzip_ns = 0;
+
+/* block functions */
+
+/*
+ * Blocks may be spilled to a backing file under memory pressure (see tier functions).
+ * Only data blocks of files are spilled, Node and ContentNode blocks always stay in memory.
+ * Every block has a state:
+ *   BLK_RESIDENT: the block is in memory;
+ *   BLK_SPILLING: the tier writer is writing the block to the backing file,
+ *                 any access cancels the spill and keeps it in memory;
+ *   BLK_SPILLED: the block is only in the backing file, it will be faulted back on access;
+ *   BLK_FAULTING: the tier writer is reading a spilled block back for prefetch_blk,
+ *                 it's still spilled until that's done;
+ *   BLK_COMPRESSED: the block is only in a compressed slot, reads go through zcache,
+ *                   a write decompresses it back to a page.
+ */
+enum BLKSTATE_T {
+    BLK_RESIDENT, BLK_SPILLING, BLK_SPILLED, BLK_FAULTING, BLK_COMPRESSED
+};
+
+/*
+ * Every block has a type, it tells what the block holds:
+ *   BLK_CONTENT: a ContentNode;
+ *   BLK_NODE: a Node;
+ *   BLK_DATA: data of a file.
+ */
+enum BLKTYPE_T {
+    BLK_CONTENT, BLK_NODE, BLK_DATA
+};
+
+unsigned char blk_state[MAX_BLK_ID];
+unsigned char blk_type[MAX_BLK_ID];
+bool blk_ref[MAX_BLK_ID];   // CLOCK bit, set on every access
+bool blk_dirty[MAX_BLK_ID]; // the memory copy is newer than the backing file
+BLKID_T blk_high = 0;       // all used block ids are below blk_high
+unsigned char* blk_zip[MAX_BLK_ID]; // compressed slot of a BLK_COMPRESSED block
+uint16_t blk_zlen[MAX_BLK_ID];      // compressed size of a BLK_COMPRESSED block
+uint32_t blk_atime[MAX_BLK_ID];     // coarse_now of the last access, see compress functions
+unsigned char blk_unzips[MAX_BLK_ID]; // decompressions into zcache since the block was compressed
+bool blk_nozip[MAX_BLK_ID];         // didn't compress well, not tried again until it's written
+
+/*
+ * zip_after is the number of seconds a data block must be untouched to be compressed,
+ * 0 if compression is disabled. coarse_now is the clock of the compressor in seconds.
+ */
+uint32_t zip_after = 0;
+volatile uint32_t coarse_now = 0;
+
+/*
+ * tier_fd is the backing file, -1 if tiering is disabled.
+ * tier_budget is the max number of data blocks kept in memory.
+ * tier_resident is the number of data blocks in memory now.
+ */
+int tier_fd = -1;
+size_t tier_budget = 0;
+size_t tier_resident = 0;
+size_t tier_spills = 0;
+size_t tier_faults = 0;
+pthread_mutex_t blk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tier_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * BlkGuard
+ * hold blk_lock for block accesses when tiering is enabled,
+ * so the tier writer never releases a block in use.
+ */
+struct BlkGuard
+{
+    BlkGuard() {
+        if (tier_fd != -1) pthread_mutex_lock(&blk_lock);
+    }
+
+    ~BlkGuard() {
+        if (tier_fd != -1) pthread_mutex_unlock(&blk_lock);
+    }
+};
+
 BLKID_T get_new_blk_id() {
     for (BLKID_T i = 0; i < MAX_BLK_ID; i++)
-        if (!blk_ids[i]) return i;
+        if (!blk_ids[i] and blk_state[i] == BLK_RESIDENT) return i;
     return -1;
 }
 
-BLKID_T register_new_blk() {
+BLKID_T register_new_blk(BLKTYPE_T type = BLK_CONTENT) {
     //printf("[*] Begin register_new_blk.\n");
+    BlkGuard guard;
     BLKID_T blk_id = get_new_blk_id();
-    blk_ids[blk_id] = mmap(NULL, PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (blk_id == -1) return -1;
+    if (!map_blk(blk_id)) return -1;
     memset(blk_ids[blk_id], 0, PAGESIZE);
+    blk_state[blk_id] = BLK_RESIDENT;
+    blk_type[blk_id] = type;
+    blk_ref[blk_id] = true;
+    blk_dirty[blk_id] = true;
+    blk_atime[blk_id] = coarse_now;
+    blk_nozip[blk_id] = false;
+    if (blk_id >= blk_high) blk_high = blk_id + 1;
+    if (type == BLK_DATA and ++tier_resident > tier_budget and tier_fd != -1) pthread_cond_signal(&tier_cond);
     //printf("[*] ... registered %lld.\n", blk_id);
     return blk_id;
 }
 
+/*
+ * read_zipped_blk
+ * get a decompressed copy of a compressed block from zcache.
+ */
+unsigned char* read_zipped_blk(BLKID_T idx) {
+    ZCacheEntry& entry = zcache[idx % ZCACHE_SIZE];
+    if (entry.idx == idx) {
+        zcache_hits++;
+        return entry.data;
+    }
+    zcache_misses++;
+    if (blk_unzips[idx] < UCHAR_MAX) blk_unzips[idx]++;
+    uint64_t begin = now_ns();
+    if (!lz_decompress(blk_zip[idx], blk_zlen[idx], entry.data, PAGESIZE)) {
+        fprintf(stderr, "vtfs: corrupted compressed block %lld\n", idx);
+        abort();
+    }
+    unzip_ns += now_ns() - begin;
+    unzip_count++;
+    entry.idx = idx;
+    return entry.data;
+}
+
+void drop_zipped_blk(BLKID_T idx) {
+    ZCacheEntry& entry = zcache[idx % ZCACHE_SIZE];
+    if (entry.idx == idx) entry.idx = -1;
+    zrelease(blk_zip[idx]);
+    zip_blocks--;
+    zip_bytes -= blk_zlen[idx];
+    blk_zip[idx] = NULL;
+    blk_state[idx] = BLK_RESIDENT;
+}
+
+/*
+ * unzip_blk
+ * decompress a block back to a page before it's written.
+ * return false and keep it compressed if there's no memory for the page.
+ */
+bool unzip_blk(BLKID_T idx) {
+    if (!map_blk(idx)) return false;
+    memcpy(blk_ids[idx], read_zipped_blk(idx), PAGESIZE);
+    drop_zipped_blk(idx);
+    if (++tier_resident > tier_budget and tier_fd != -1) pthread_cond_signal(&tier_cond);
+    return true;
+}
+
 void free_blk_id(BLKID_T blk_id) {
-    munmap(blk_ids[blk_id], PAGESIZE);
+    BlkGuard guard;
+    if (blk_state[blk_id] == BLK_COMPRESSED) {
+        drop_zipped_blk(blk_id);
+    } else if (blk_state[blk_id] != BLK_SPILLED and blk_state[blk_id] != BLK_FAULTING) {
+        unmap_blk(blk_id);
+        if (blk_type[blk_id] == BLK_DATA) tier_resident--;
+    }
+    blk_state[blk_id] = BLK_RESIDENT;
+    blk_type[blk_id] = BLK_CONTENT;
+}
+
+/*
+ * touch_blk
+ * get the memory of a block for an access, fault it back from the backing file
+ * or decompress it if needed. A read of a compressed block gets its copy in zcache.
+ * return NULL with errno set to ENOMEM or EIO if that fails, the block is left
+ * spilled or compressed. Node and ContentNode blocks are always resident and never fail.
+ * blk_lock must be held if tiering is enabled.
+ */
+char* touch_blk(BLKID_T idx, bool write) {
+    if (zip_after) {
+        blk_atime[idx] = coarse_now;
+        if (write) blk_nozip[idx] = false;
+        if (blk_state[idx] == BLK_COMPRESSED) {
+            // a block that keeps falling out of zcache is hot, it gets its page back if there's memory
+            if (!write and (blk_unzips[idx] < ZIP_PROMOTE_UNZIPS or !unzip_blk(idx)))
+                return (char*)read_zipped_blk(idx);
+            if (write and !unzip_blk(idx)) {
+                errno = ENOMEM;
+                return NULL;
+            }
+        }
+    }
+    if (tier_fd == -1) return (char*)blk_ids[idx];
+    if (blk_state[idx] == BLK_SPILLING) {
+        blk_state[idx] = BLK_RESIDENT;
+    } else if (blk_state[idx] == BLK_SPILLED or blk_state[idx] == BLK_FAULTING) {
+        if (!map_blk(idx)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (pread(tier_fd, blk_ids[idx], PAGESIZE, idx * PAGESIZE) != (ssize_t)PAGESIZE) {
+            fprintf(stderr, "vtfs: cannot fault in block %lld from backing file\n", idx);
+            unmap_blk(idx);
+            errno = EIO;
+            return NULL;
+        }
+        blk_state[idx] = BLK_RESIDENT;
+        tier_faults++;
+        if (++tier_resident > tier_budget) pthread_cond_signal(&tier_cond);
+    }
+    blk_ref[idx] = true;
+    if (write) blk_dirty[idx] = true;
+    return (char*)blk_ids[idx];
 }
 
-void write_to_blk(BLKID_T idx, const void* data, size_t size) {
+/*
+ * write_to_blk, write_to_blk_offset, read_from_blk, read_from_blk_offset
+ * return 0, or -ENOMEM or -EIO if the block can't be brought back, see touch_blk.
+ */
+int write_to_blk(BLKID_T idx, const void* data, size_t size) {
     if (size == 0 or size > PAGESIZE) size = PAGESIZE;
-    memcpy(blk_ids[idx], data, size);
+    BlkGuard guard;
+    char* page = touch_blk(idx, true);
+    if (!page) return -errno;
+    memcpy(page, data, size);
+    return 0;
 }
 
-void write_to_blk_offset(BLKID_T idx, const void* data, off_t offset, size_t size) {
+int write_to_blk_offset(BLKID_T idx, const void* data, off_t offset, size_t size) {
     if (size == 0 or offset + size > PAGESIZE) size = PAGESIZE - offset;
-    memcpy((char*)blk_ids[idx] + offset, data, size);
+    BlkGuard guard;
+    char* page = touch_blk(idx, true);
+    if (!page) return -errno;
+    memcpy(page + offset, data, size);
+    return 0;
 }
 
-void read_from_blk(BLKID_T idx, void* data, size_t size) {
+int read_from_blk(BLKID_T idx, void* data, size_t size) {
     if (size == 0 or size > PAGESIZE) size = PAGESIZE;
-    memcpy(data, blk_ids[idx], size);
+    BlkGuard guard;
+    char* page = touch_blk(idx, false);
+    if (!page) return -errno;
+    memcpy(data, page, size);
+    return 0;
 }
 
-void read_from_blk_offset(BLKID_T idx, void* data, off_t offset, size_t size) {
+int read_from_blk_offset(BLKID_T idx, void* data, off_t offset, size_t size) {
     if (size == 0 or offset + size > PAGESIZE) size = PAGESIZE - offset;
-    memcpy(data, (char*)blk_ids[idx] + offset, size);
+    BlkGuard guard;
+    char* page = touch_blk(idx, false);
+    if (!page) return -errno;
+    memcpy(data, page + offset, size);
+    return 0;
+}
+
+/* tier functions */
+
+/*
+ * pick_victim
+ * find a resident data block that was not accessed since the last sweep (CLOCK).
+ * blk_lock must be held.
+ */
+BLKID_T pick_victim() {
+    static BLKID_T hand = 0;
+    for (BLKID_T n = 0; n < 2 * blk_high; n++) {
+        BLKID_T idx = hand;
+        hand = (hand + 1) % blk_high;
+        if (blk_type[idx] != BLK_DATA or blk_state[idx] != BLK_RESIDENT) continue;
+        if (blk_ref[idx]) blk_ref[idx] = false;
+        else return idx;
+    }
+    return -1;
+}
+
+/*
+ * prefetch_blk
+ * hint that a block will be read soon. A spilled block is queued to be faulted in
+ * by the tier writer, in the order of the hints.
+ */
+const size_t PREFETCH_QUEUE_MAX = 1024;
+deque<BLKID_T> prefetch_queue;
+
+void prefetch_blk(BLKID_T idx) {
+    BlkGuard guard;
+    if (blk_state[idx] == BLK_SPILLED) {
+        if (prefetch_queue.size() < PREFETCH_QUEUE_MAX) prefetch_queue.push_back(idx);
+        pthread_cond_signal(&tier_cond);
+    }
+}
+
+/*
+ * release_blk
+ * drop the memory of a block that has an up-to-date copy in the backing file.
+ * blk_lock must be held.
+ */
+void release_blk(BLKID_T idx) {
+    unmap_blk(idx);
+    blk_state[idx] = BLK_SPILLED;
+    tier_resident--;
+    tier_spills++;
+}
+
+/*
+ * tier_writer
+ * the thread that spills cold data blocks while there are more than tier_budget in memory,
+ * and faults in the blocks queued by prefetch_blk.
+ * The pwrite is done without blk_lock, a block accessed meanwhile is kept in memory.
+ * So is the pread of a prefetch, a block accessed meanwhile is faulted in by the access.
+ */
+void* tier_writer(void* arg) {
+    static char page[PAGESIZE];
+    pthread_mutex_lock(&blk_lock);
+    while (true) {
+        while (tier_resident <= tier_budget and prefetch_queue.empty()) pthread_cond_wait(&tier_cond, &blk_lock);
+        while (!prefetch_queue.empty()) {
+            BLKID_T idx = prefetch_queue.front();
+            prefetch_queue.pop_front();
+            if (blk_state[idx] != BLK_SPILLED) continue;
+            blk_state[idx] = BLK_FAULTING;
+            pthread_mutex_unlock(&blk_lock);
+            bool ok = pread(tier_fd, page, PAGESIZE, idx * PAGESIZE) == (ssize_t)PAGESIZE;
+            pthread_mutex_lock(&blk_lock);
+            if (blk_state[idx] != BLK_FAULTING) continue; // faulted in or freed meanwhile
+            blk_state[idx] = BLK_SPILLED;
+            if (!ok or !map_blk(idx)) continue;
+            memcpy(blk_ids[idx], page, PAGESIZE);
+            blk_state[idx] = BLK_RESIDENT;
+            blk_ref[idx] = true;
+            tier_faults++;
+            tier_resident++;
+        }
+        if (tier_resident <= tier_budget) continue;
+        BLKID_T victim = pick_victim();
+        if (victim == -1) {
+            // everything is in use, wait for the next allocation or fault
+            pthread_cond_wait(&tier_cond, &blk_lock);
+            continue;
+        }
+        if (!blk_dirty[victim]) {
+            release_blk(victim);
+            continue;
+        }
+        blk_state[victim] = BLK_SPILLING;
+        blk_dirty[victim] = false;
+        memcpy(page, blk_ids[victim], PAGESIZE);
+        pthread_mutex_unlock(&blk_lock);
+        bool ok = pwrite(tier_fd, page, PAGESIZE, victim * PAGESIZE) == (ssize_t)PAGESIZE;
+        pthread_mutex_lock(&blk_lock);
+        if (!ok) {
+            perror("vtfs: spill to backing file");
+            blk_dirty[victim] = true;
+            if (blk_state[victim] == BLK_SPILLING) blk_state[victim] = BLK_RESIDENT;
+        } else if (blk_state[victim] == BLK_SPILLING) {
+            release_blk(victim);
+        }
+    }
+    return NULL;
+}
+
+bool open_tier(const char* filename, size_t budget_mb) {
+    tier_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (tier_fd == -1) return false;
+    tier_budget = budget_mb * 1024 * 1024 / PAGESIZE;
+    return true;
+}
+
+void start_tier() {
+    if (tier_fd == -1) return;
+    pthread_t thread;
+    pthread_create(&thread, NULL, tier_writer, NULL);
+    pthread_detach(thread);
+}
+
+void dump_tier_stats(FILE* f) {
+    if (tier_fd == -1) return;
+    BlkGuard guard;
+    fprintf(f, "tier: %zu/%zu data blocks resident, %zu spills, %zu faults\n",
+            tier_resident, tier_budget, tier_spills, tier_faults);
 }
 
 /* node functions */
@@ -209,10 +908,14 @@ void create_super_node()
     Node super_node;
     memset(&super_node, 0, sizeof(Node));
     super_node.set_node_id(get_node_id());
-    super_node.set_blk_id(register_new_blk());
+    super_node.set_blk_id(register_new_blk(BLK_NODE));
     super_node.set_node_type(NODE_DIR);
     super_node.set_name("/");
     super_node.set_content(register_new_blk());
+    if (super_node.blk_id == -1 or super_node.content == -1) {
+        fprintf(stderr, "vtfs: out of memory to create the root directory\n");
+        abort();
+    }
     super_node.set_st(get_default_stat());
     write_to_blk(super_node.blk_id, &super_node, sizeof(Node));
 }
@@ -257,11 +960,11 @@ BLKID_T get_blk_id_of_node(NODEID_T tar_nid, BLKID_T cur_blkid = 0) {
     return -1;
 }
 
-void append_id_to_content_node(BLKID_T to_append, BLKID_T blk_id)
+bool append_id_to_content_node(BLKID_T to_append, BLKID_T blk_id)
 {
     ContentNode content = get_content_node_by_blk_id(blk_id);
     if (content.ids[IDX_PER_PAGE - 1]) {
-        append_id_to_content_node(to_append, content.ids[IDX_PER_PAGE - 1]);
+        return append_id_to_content_node(to_append, content.ids[IDX_PER_PAGE - 1]);
     } else {
         size_t target = IDX_PER_PAGE;
         for (size_t i = 0; i < IDX_PER_PAGE - 1; i++) {
@@ -271,11 +974,15 @@ void append_id_to_content_node(BLKID_T to_append, BLKID_T blk_id)
             }
         }
         if (target == IDX_PER_PAGE) { // not fount space
-            content.ids[IDX_PER_PAGE - 1] = register_new_blk();
-            append_id_to_content_node(to_append, content.ids[IDX_PER_PAGE - 1]);
+            BLKID_T next = register_new_blk();
+            if (next == -1) return false;
+            content.ids[IDX_PER_PAGE - 1] = next;
+            write_to_blk(blk_id, &content, sizeof(ContentNode));
+            return append_id_to_content_node(to_append, next);
         } else {
             content.ids[target] = to_append;
             write_to_blk(blk_id, &content, sizeof(ContentNode));
+            return true;
         }
     }
 }
@@ -292,19 +999,29 @@ Node get_node_by_node_id(NODEID_T nid)
 NODEID_T create_node(NODETYPE_T node_type, const char* name, NODEID_T parent_nid = 0, const struct stat* st = NULL)
 {
     //printf("[*] Begin create node. (parent_nid = %lld)\n", parent_nid);
+    BLKID_T blk_id = register_new_blk(BLK_NODE);
+    if (blk_id == -1) return -1;
+    BLKID_T content_blk = register_new_blk();
+    if (content_blk == -1) {
+        free_blk_id(blk_id);
+        return -1;
+    }
     NODEID_T nid = get_node_id();
-    BLKID_T blk_id = register_new_blk();
     Node new_node;
     new_node.set_node_id(nid);
     new_node.set_blk_id(blk_id);
     new_node.set_node_type(node_type);
     new_node.set_name(name);
-    new_node.set_content(register_new_blk());
+    new_node.set_content(content_blk);
     if (st) new_node.set_st(st);
     else new_node.set_st(get_default_stat(node_type == NODE_DIR));
     write_to_blk(blk_id, &new_node, sizeof(Node));
     Node parent_node = get_node_by_node_id(parent_nid);
-    append_id_to_content_node(blk_id, parent_node.content);
+    if (!append_id_to_content_node(blk_id, parent_node.content)) {
+        free_blk_id(content_blk);
+        free_blk_id(blk_id);
+        return -1;
+    }
     //printf("Create: %lld\n", nid);
     
     return nid;
@@ -397,7 +1114,7 @@ Node get_node_by_path(const char* path, NODEID_T parent_nid = 0) {
         return get_node_by_path(pos + 1, subnode.node_id);
 }
 
-void create_node_by_path(const char* path, const struct stat* st, NODEID_T parent_nid = 0, NODETYPE_T node_type = NODE_FILE) {
+int create_node_by_path(const char* path, const struct stat* st, NODEID_T parent_nid = 0, NODETYPE_T node_type = NODE_FILE) {
     //printf("[+] create_node_by_path path=%s parent_node=%lld\n", path, parent_nid);
     char target[FILENAME_LEN];
     const char* pos = strchr(path, '/');
@@ -408,68 +1125,198 @@ void create_node_by_path(const char* path, const struct stat* st, NODEID_T paren
     }
     Node parent_node = get_node_by_node_id(parent_nid);
     if (pos == NULL)
-        create_node(node_type, target, parent_node.node_id, st);
+        return create_node(node_type, target, parent_node.node_id, st) == -1 ? -ENOSPC : 0;
     else {
         Node curnode = get_node_by_name_from_content(target, get_content_node_by_blk_id(parent_node.content));
-        create_node_by_path(pos + 1, st, curnode.node_id, node_type);
+        return create_node_by_path(pos + 1, st, curnode.node_id, node_type);
     }
 }
 
-void read_from_node(const Node& node, char* buf, off_t offset, off_t size) {
+/*
+ * FileCursor remembers a ContentNode of a file: the ctn_idx-th ContentNode is ctn_blk.
+ * A sequential stream resumes from it instead of walking the chain from node.content.
+ */
+struct FileCursor
+{
+    off_t ctn_idx;
+    BLKID_T ctn_blk; // 0 if the cursor is not set
+};
+
+/*
+ * seek_content_blk
+ * get the block id of the ctn_idx-th ContentNode of a node, start from the cursor if possible.
+ */
+BLKID_T seek_content_blk(const Node& node, off_t ctn_idx, FileCursor* cursor = NULL) {
     BLKID_T content_blk = node.content;
-    
+    off_t cur_idx = 0;
+    if (cursor and cursor->ctn_blk and cursor->ctn_idx <= ctn_idx) {
+        content_blk = cursor->ctn_blk;
+        cur_idx = cursor->ctn_idx;
+    }
+    for (; cur_idx < ctn_idx; cur_idx++) content_blk = get_content_node_by_blk_id(content_blk).ids[IDX_PER_PAGE - 1];
+    return content_blk;
+}
+
+/* handle functions */
+
+/*
+ * FileHandle is kept in `fi->fh` from open/create to release.
+ * attributes:
+ *   blk_id: the block of the node, so the path is not resolved again;
+ *   cursor: where the last read/write ended in the ContentNode chain;
+ *   next_offset: the offset right after the last read/write;
+ *   streak: the number of consecutive sequential reads/writes.
+ */
+struct FileHandle
+{
+    BLKID_T blk_id;
+    FileCursor cursor;
+    off_t next_offset;
+    int streak;
+};
+
+/*
+ * OpenNode pins a node while it has handles.
+ * An unlinked node is only freed when its last handle is released.
+ */
+struct OpenNode
+{
+    vector<FileHandle*> handles;
+    bool unlinked;
+};
+
+map<BLKID_T, OpenNode> open_nodes;
+pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+FileHandle* open_handle(const Node& node) {
+    FileHandle* fh = new FileHandle;
+    memset(fh, 0, sizeof(FileHandle));
+    fh->blk_id = node.blk_id;
+    pthread_mutex_lock(&handle_lock);
+    open_nodes[node.blk_id].handles.push_back(fh);
+    pthread_mutex_unlock(&handle_lock);
+    return fh;
+}
+
+/*
+ * reset_cursors
+ * ContentNodes of a node are freed by shrinking, forget them in all of its handles.
+ */
+void reset_cursors(BLKID_T blk_id) {
+    pthread_mutex_lock(&handle_lock);
+    map<BLKID_T, OpenNode>::iterator it = open_nodes.find(blk_id);
+    if (it != open_nodes.end()) {
+        for (size_t i = 0; i < it->second.handles.size(); i++)
+            it->second.handles[i]->cursor.ctn_blk = 0;
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/*
+ * defer_free
+ * return true if the node is open, it will be freed by the last release.
+ */
+bool defer_free(BLKID_T blk_id) {
+    pthread_mutex_lock(&handle_lock);
+    map<BLKID_T, OpenNode>::iterator it = open_nodes.find(blk_id);
+    bool pinned = it != open_nodes.end();
+    if (pinned) it->second.unlinked = true;
+    pthread_mutex_unlock(&handle_lock);
+    return pinned;
+}
+
+/*
+ * read_from_node
+ * return size, or -ENOMEM or -EIO if a block can't be brought back, see touch_blk.
+ */
+off_t read_from_node(const Node& node, char* buf, off_t offset, off_t size, FileCursor* cursor = NULL) {
+    off_t total = size;
+    int err = 0;
     // calculate start point
     off_t ctn_offset = offset / SPC_PER_PAGE;
     off_t idx_offset = (offset - ctn_offset * SPC_PER_PAGE ) / PAGESIZE;
     off_t blk_offset = (offset - ctn_offset * SPC_PER_PAGE - idx_offset * PAGESIZE);
-    while(ctn_offset--) content_blk = get_content_node_by_blk_id(content_blk).ids[IDX_PER_PAGE - 1];
+    BLKID_T content_blk = seek_content_blk(node, ctn_offset, cursor);
     
     ContentNode content = get_content_node_by_blk_id(content_blk);
     
     // read first block
     off_t read_size = PAGESIZE - blk_offset;
     if (size < read_size) read_size = size;
-    read_from_blk_offset(content.ids[idx_offset], buf, blk_offset, read_size);
+    err = read_from_blk_offset(content.ids[idx_offset], buf, blk_offset, read_size);
+    if (err) return err;
     buf += read_size;
     size -= read_size;
     idx_offset += 1;
     if (idx_offset == IDX_PER_PAGE - 1) {
-        content = get_content_node_by_blk_id(content.ids[IDX_PER_PAGE - 1]);
+        content_blk = content.ids[IDX_PER_PAGE - 1];
+        content = get_content_node_by_blk_id(content_blk);
+        ctn_offset += 1;
         idx_offset = 0;   
     }
     
     while(size > 0) {
         if (size > PAGESIZE) {    
-            read_from_blk_offset(content.ids[idx_offset], buf, 0, PAGESIZE);
+            err = read_from_blk_offset(content.ids[idx_offset], buf, 0, PAGESIZE);
+            if (err) return err;
             buf += PAGESIZE;
             size -= PAGESIZE;
             idx_offset += 1;
             if (idx_offset == IDX_PER_PAGE - 1) {
-                content = get_content_node_by_blk_id(content.ids[IDX_PER_PAGE - 1]);
+                content_blk = content.ids[IDX_PER_PAGE - 1];
+                content = get_content_node_by_blk_id(content_blk);
+                ctn_offset += 1;
                 idx_offset = 0;
             }
         } else {    
-            read_from_blk_offset(content.ids[idx_offset], buf, 0, size);
+            err = read_from_blk_offset(content.ids[idx_offset], buf, 0, size);
+            if (err) return err;
             buf += size;
             size -= size;
             idx_offset += 1;
             if (idx_offset == IDX_PER_PAGE - 1) {
-                content = get_content_node_by_blk_id(content.ids[IDX_PER_PAGE - 1]);
+                content_blk = content.ids[IDX_PER_PAGE - 1];
+                content = get_content_node_by_blk_id(content_blk);
+                ctn_offset += 1;
                 idx_offset = 0;           
             }
         }
-    }    
+    }
+    // the stream continues from here next time
+    if (cursor and content_blk) {
+        cursor->ctn_idx = ctn_offset;
+        cursor->ctn_blk = content_blk;
+    }
+    return total;
 }
 
 
-void write_to_node(const Node& node, const char* buf, off_t offset, off_t size) {
-    BLKID_T content_blk = node.content;
-    
+/*
+ * get_data_blk
+ * make sure slot idx of a content node has a data block, return false if out of blocks.
+ */
+bool get_data_blk(ContentNode& content, off_t idx, BLKID_T content_blk) {
+    if (content.ids[idx] != 0) return true;
+    BLKID_T blk_id = register_new_blk(BLK_DATA);
+    if (blk_id == -1) return false;
+    content.ids[idx] = blk_id;
+    write_to_blk(content_blk, &content, sizeof(ContentNode));
+    return true;
+}
+
+/*
+ * write_to_node
+ * return the number of bytes written, less than size if the blocks run out or can't be
+ * brought back, -ENOSPC, -ENOMEM or -EIO if nothing was written.
+ */
+off_t write_to_node(const Node& node, const char* buf, off_t offset, off_t size, FileCursor* cursor = NULL) {
+    off_t total = size;
+    int err = 0;
     // calculate start point
     off_t ctn_offset = offset / SPC_PER_PAGE;
     off_t idx_offset = (offset - ctn_offset * SPC_PER_PAGE ) / PAGESIZE;
     off_t blk_offset = (offset - ctn_offset * SPC_PER_PAGE - idx_offset * PAGESIZE);
-    while(ctn_offset--) content_blk = get_content_node_by_blk_id(content_blk).ids[IDX_PER_PAGE - 1];
+    BLKID_T content_blk = seek_content_blk(node, ctn_offset, cursor);
 
     ContentNode content = get_content_node_by_blk_id(content_blk);
     
@@ -477,45 +1324,53 @@ void write_to_node(const Node& node, const char* buf, off_t offset, off_t size)
     off_t read_size = PAGESIZE - blk_offset;
     if (size < read_size) read_size = size;
 
-    if (content.ids[idx_offset] == 0) content.ids[idx_offset] = register_new_blk();
-    write_to_blk(content_blk, &content, sizeof(ContentNode));
-
-
-    write_to_blk_offset(content.ids[idx_offset], buf, blk_offset, read_size);
+    if (!get_data_blk(content, idx_offset, content_blk)) return -ENOSPC;
+    err = write_to_blk_offset(content.ids[idx_offset], buf, blk_offset, read_size);
+    if (err) return err;
     buf += read_size;
     size -= read_size;
     idx_offset += 1;
     if (idx_offset == IDX_PER_PAGE - 1) {
-        content = get_content_node_by_blk_id(content.ids[IDX_PER_PAGE - 1]);
+        content_blk = content.ids[IDX_PER_PAGE - 1];
+        content = get_content_node_by_blk_id(content_blk);
+        ctn_offset += 1;
         idx_offset = 0;
     }
 
     while(size > 0) {
         if (size > PAGESIZE) {
     
-            if (content.ids[idx_offset] == 0) content.ids[idx_offset] = register_new_blk();
-            write_to_blk(content_blk, &content, sizeof(ContentNode));
-            write_to_blk_offset(content.ids[idx_offset], buf, 0, PAGESIZE);
+            if (!get_data_blk(content, idx_offset, content_blk)) return total - size;
+            if (write_to_blk_offset(content.ids[idx_offset], buf, 0, PAGESIZE)) return total - size;
             buf += PAGESIZE;
             size -= PAGESIZE;
             idx_offset += 1;
             if (idx_offset == IDX_PER_PAGE - 1) {
-                content = get_content_node_by_blk_id(content.ids[IDX_PER_PAGE - 1]);
+                content_blk = content.ids[IDX_PER_PAGE - 1];
+                content = get_content_node_by_blk_id(content_blk);
+                ctn_offset += 1;
                 idx_offset = 0;
             }
         } else {
-            if (content.ids[idx_offset] == 0) content.ids[idx_offset] = register_new_blk();
-            write_to_blk(content_blk, &content, sizeof(ContentNode));
-            write_to_blk_offset(content.ids[idx_offset], buf, 0, size);
+            if (!get_data_blk(content, idx_offset, content_blk)) return total - size;
+            if (write_to_blk_offset(content.ids[idx_offset], buf, 0, size)) return total - size;
             buf += size;
             size -= size;
             idx_offset += 1;
             if (idx_offset == IDX_PER_PAGE - 1) {
-                content = get_content_node_by_blk_id(content.ids[IDX_PER_PAGE - 1]);
+                content_blk = content.ids[IDX_PER_PAGE - 1];
+                content = get_content_node_by_blk_id(content_blk);
+                ctn_offset += 1;
                 idx_offset = 0;                
             }
         }
     }
+    // the stream continues from here next time
+    if (cursor and content_blk) {
+        cursor->ctn_idx = ctn_offset;
+        cursor->ctn_blk = content_blk;
+    }
+    return total;
 }
 
 void free_content_blk(BLKID_T content_blk) {
@@ -531,7 +1386,11 @@ void free_content_blk(BLKID_T content_blk) {
     }
 }
 
-void realloc_node_size(Node node, size_t size) {
+/*
+ * realloc_node_size
+ * return false and keep the old size if the content nodes to grow the file can't be allocated.
+ */
+bool realloc_node_size(Node node, size_t size, FileCursor* cursor = NULL) {
     //printf("[+] realloc_node_size node_id=%lld, size=%lu\n", node.node_id, size);
     off_t old_size = node.st.st_size;
     off_t new_size = size;
@@ -539,19 +1398,29 @@ void realloc_node_size(Node node, size_t size) {
     off_t old_content_blk_num = old_size / SPC_PER_PAGE + 1;
     off_t new_content_blk_num = new_size / SPC_PER_PAGE + 1;
     if (new_size >= old_size) {
+        off_t new_page_num = new_content_blk_num - old_content_blk_num;
         // find last page
-        BLKID_T content_blk = node.content;
-        for (off_t _ = 0; _ + 1 < old_content_blk_num; _++) {
-            ContentNode content = get_content_node_by_blk_id(content_blk);
-            content_blk = content.ids[IDX_PER_PAGE - 1];
-        }
-        off_t new_page_num = new_content_blk_num - old_content_blk_num;
-        
+        BLKID_T content_blk = 0;
+        if (new_page_num > 0) content_blk = seek_content_blk(node, old_content_blk_num - 1, cursor);
+
+        BLKID_T last_blk = content_blk;
         for (off_t _ = 0; _ < new_page_num; _++) {
+            BLKID_T next = register_new_blk();
+            if (next == -1) {
+                // unlink and free what was appended so far
+                ContentNode last = get_content_node_by_blk_id(last_blk);
+                BLKID_T appended = last.ids[IDX_PER_PAGE-1];
+                if (appended) {
+                    last.ids[IDX_PER_PAGE-1] = 0;
+                    write_to_blk(last_blk, &last, sizeof(ContentNode));
+                    free_content_blk(appended);
+                }
+                return false;
+            }
             ContentNode content = get_content_node_by_blk_id(content_blk);
-            content.ids[IDX_PER_PAGE-1] = register_new_blk();
+            content.ids[IDX_PER_PAGE-1] = next;
             write_to_blk(content_blk, &content, sizeof(ContentNode));
-            content_blk = content.ids[IDX_PER_PAGE-1];
+            content_blk = next;
         }
     } else {
         
@@ -567,10 +1436,12 @@ void realloc_node_size(Node node, size_t size) {
             content.ids[IDX_PER_PAGE-1] = 0;
             write_to_blk(cur_content_blk, &content, sizeof(ContentNode));
             free_content_blk(next_content_blk);
+            reset_cursors(node.blk_id);
         }
     }
     node.st.st_size = size;
     write_to_blk(node.blk_id, &node, sizeof(Node));
+    return true;
 }
 
 void shift_left_content(off_t idx, BLKID_T content_blk) {
@@ -592,15 +1463,469 @@ void remove_record_from_content(BLKID_T to_remove, BLKID_T content_blk) {
     shift_left_content(ret.first, ret.second);
 }
 
-void remove_node(const Node& node) {
+void free_node(const Node& node) {
     // release all space of the node
     realloc_node_size(node, 0);
+    // free all the space
+    if (node.node_type == NODE_FILE) free_content_blk(node.content);
+    else free_blk_id(node.content);
+    free_blk_id(node.blk_id);
+}
+
+void remove_node(const Node& node) {
     // delete record from parent
     Node parent_node = get_node_by_node_id(get_parent_nid(node));
     remove_record_from_content(node.blk_id, parent_node.content);
-    // free all the space
-    free_blk_id(node.content);
-    free_blk_id(node.blk_id);
+    // an open node is freed by its last release
+    if (!defer_free(node.blk_id)) free_node(node);
+}
+
+void close_handle(FileHandle* fh) {
+    pthread_mutex_lock(&handle_lock);
+    map<BLKID_T, OpenNode>::iterator it = open_nodes.find(fh->blk_id);
+    vector<FileHandle*>& handles = it->second.handles;
+    handles.erase(find(handles.begin(), handles.end(), fh));
+    bool to_free = false;
+    if (handles.empty()) {
+        to_free = it->second.unlinked;
+        open_nodes.erase(it);
+    }
+    pthread_mutex_unlock(&handle_lock);
+    if (to_free) free_node(get_node_by_blk_id(fh->blk_id));
+    delete fh;
+}
+
+/*
+ * Readahead window of a sequential stream grows by READAHEAD_STEP blocks
+ * with every sequential read, up to READAHEAD_MAX blocks.
+ */
+const off_t READAHEAD_STEP = 8;
+const off_t READAHEAD_MAX = 64;
+
+/*
+ * readahead
+ * prefetch the data blocks after the end of the last read of a sequential stream.
+ * Only spilled blocks are prefetched, so it's skipped without a backing file.
+ * Compressed blocks are left to be decompressed by the read that needs them.
+ */
+void readahead(const Node& node, FileHandle* fh) {
+    if (tier_fd == -1) return;
+    off_t window = min(fh->streak * READAHEAD_STEP, READAHEAD_MAX);
+    off_t offset = fh->next_offset;
+    off_t end = min(offset + window * (off_t)PAGESIZE, (off_t)node.st.st_size);
+    if (offset >= end) return;
+    off_t ctn_offset = offset / SPC_PER_PAGE;
+    off_t idx_offset = (offset - ctn_offset * SPC_PER_PAGE) / PAGESIZE;
+    BLKID_T content_blk = seek_content_blk(node, ctn_offset, &fh->cursor);
+    ContentNode content = get_content_node_by_blk_id(content_blk);
+    for (off_t pos = offset - offset % PAGESIZE; pos < end; pos += PAGESIZE) {
+        if (content.ids[idx_offset]) prefetch_blk(content.ids[idx_offset]);
+        idx_offset += 1;
+        if (idx_offset == IDX_PER_PAGE - 1) {
+            content_blk = content.ids[IDX_PER_PAGE - 1];
+            if (!content_blk) break;
+            content = get_content_node_by_blk_id(content_blk);
+            idx_offset = 0;
+        }
+    }
+}
+
+/*
+ * get_node_of_op
+ * get the node of a FUSE operation from its handle, or from its path if there's no handle.
+ */
+Node get_node_of_op(const char* path, struct fuse_file_info* fi) {
+    if (fi and fi->fh) return get_node_by_blk_id(((FileHandle*)fi->fh)->blk_id);
+    if (!path) return NotExistsNode;
+    return get_node_by_path(path + 1);
+}
+
+/* compact functions */
+
+/*
+ * fs_lock serializes FUSE operations with the compactor,
+ * which moves blocks of any node between its steps.
+ */
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct FsGuard
+{
+    FsGuard() {
+        pthread_mutex_lock(&fs_lock);
+    }
+
+    ~FsGuard() {
+        pthread_mutex_unlock(&fs_lock);
+    }
+};
+
+/*
+ * The compactor visits Node blocks in block id order, one pass after another.
+ * For every node it builds a run: the ContentNode chain, each followed by the
+ * data blocks (file) or the Node blocks of the entries (dir) it points to.
+ * A fragmented run is copied into consecutive slots of compact_chunk.
+ * Block ids never change, so ContentNodes and cursors stay valid, only blk_ids is updated.
+ *
+ * Every step examines about COMPACT_STEP_BLKS blocks with fs_lock held, then sleeps
+ * COMPACT_STEP_DELAY us. A run is moved if more than 1/COMPACT_MIN_FRAG of its
+ * neighbours are not adjacent, or if it has blocks in a chunk less than 1/4 used.
+ * A run being moved is kept in compact_run between steps. Its blocks may be freed or
+ * reused meanwhile, which is harmless: freed ones have no page and are skipped,
+ * blocks added later are in the run of the next pass.
+ */
+const size_t COMPACT_STEP_BLKS = 256;
+const useconds_t COMPACT_STEP_DELAY = 10000;
+const size_t COMPACT_MIN_FRAG = 16;
+
+size_t compact_interval = 1000;   // ms between passes, 0 disables the compactor
+size_t compact_chunk = MAX_CHUNK; // the chunk runs are moved into, MAX_CHUNK if none
+size_t compact_top = 0;           // the next free slot of compact_chunk
+BLKID_T compact_next = 0;         // the next node to measure
+vector<BLKID_T> compact_run;      // the run being moved
+size_t compact_pos = 0;           // where to continue in compact_run
+size_t compact_moved = 0;
+size_t pass_moved = 0;            // blocks moved in the current pass
+size_t frag_breaks = 0, frag_pairs = 0; // of the current pass
+double frag_ratio = 0;            // non-adjacent neighbours / all neighbours, of the last pass
+
+/*
+ * trim_dir_content
+ * shift_left_content leaves empty ContentNodes at the end of a dir, free them.
+ */
+void trim_dir_content(const Node& node) {
+    BLKID_T content_blk = node.content;
+    while (content_blk) {
+        ContentNode content = get_content_node_by_blk_id(content_blk);
+        BLKID_T next_content_blk = content.ids[IDX_PER_PAGE - 1];
+        if (next_content_blk and get_content_node_by_blk_id(next_content_blk).ids[0] == 0) {
+            content.ids[IDX_PER_PAGE - 1] = 0;
+            write_to_blk(content_blk, &content, sizeof(ContentNode));
+            free_content_blk(next_content_blk);
+            return;
+        }
+        content_blk = next_content_blk;
+    }
+}
+
+void get_run(const Node& node, vector<BLKID_T>& run) {
+    // the super node is in no dir, its run starts with itself
+    if (node.node_id == 0) run.push_back(node.blk_id);
+    BLKID_T content_blk = node.content;
+    while (content_blk) {
+        run.push_back(content_blk);
+        ContentNode content = get_content_node_by_blk_id(content_blk);
+        for (size_t i = 0; i < IDX_PER_PAGE - 1; i++) {
+            if (content.ids[i]) run.push_back(content.ids[i]);
+            else if (node.node_type == NODE_DIR) break;
+        }
+        content_blk = content.ids[IDX_PER_PAGE - 1];
+    }
+}
+
+/*
+ * measure_run
+ * count the non-adjacent neighbours of a run, crossing a chunk boundary is fine.
+ * return true if the run should be moved. blk_lock must be held.
+ */
+bool measure_run(const vector<BLKID_T>& run) {
+    size_t breaks = 0, pairs = 0;
+    bool sparse = false;
+    char* prev = NULL;
+    bool prev_at_end = false;
+    for (size_t i = 0; i < run.size(); i++) {
+        char* page = (char*)blk_ids[run[i]];
+        if (!page) continue; // spilled
+        size_t c = blk_chunk[run[i]];
+        if (prev) {
+            pairs++;
+            bool chunk_boundary = prev_at_end and page == chunks[c].base;
+            if (page != prev + PAGESIZE and !chunk_boundary) breaks++;
+        }
+        if (c != compact_chunk and c != alloc_chunk and chunks[c].used * 4 < CHUNK_PAGES) sparse = true;
+        prev = page;
+        prev_at_end = page == chunks[c].base + (CHUNK_PAGES - 1) * PAGESIZE;
+    }
+    frag_breaks += breaks;
+    frag_pairs += pairs;
+    return breaks * COMPACT_MIN_FRAG > pairs or sparse;
+}
+
+/*
+ * move_to_compact_chunk
+ * move a block to the next slot of compact_chunk. blk_lock must be held.
+ */
+void move_to_compact_chunk(BLKID_T idx) {
+    if (!blk_ids[idx]) return;
+    if (compact_chunk == MAX_CHUNK or compact_top == CHUNK_PAGES) {
+        if (compact_chunk != MAX_CHUNK) chunks[compact_chunk].reserved = false;
+        long c = map_chunk();
+        if (c == -1) return;
+        chunks[c].reserved = true;
+        compact_chunk = c;
+        compact_top = 0;
+    }
+    Chunk& chunk = chunks[compact_chunk];
+    chunk.slot_used[compact_top] = true;
+    chunk.used++;
+    put_blk(idx, compact_chunk, compact_top++);
+    compact_moved++;
+    pass_moved++;
+}
+
+void end_compact_pass() {
+    size_t live = 0;
+    for (size_t c = 0; c < MAX_CHUNK; c++)
+        if (chunks[c].base) live += chunks[c].used;
+    frag_ratio = frag_pairs ? (double)frag_breaks / frag_pairs : 0;
+    if (pass_moved)
+        printf("[.] vtfs_compact fragmentation=%.2f%% chunks=%zu occupancy=%.2f%% moved=%zu\n",
+               frag_ratio * 100, chunk_num, chunk_num ? live * 100.0 / (chunk_num * CHUNK_PAGES) : 0, pass_moved);
+    frag_breaks = frag_pairs = 0;
+    pass_moved = 0;
+    compact_next = 0;
+}
+
+/*
+ * compact_step
+ * examine about COMPACT_STEP_BLKS blocks, return false at the end of a pass.
+ */
+bool compact_step() {
+    FsGuard guard;
+    size_t budget = COMPACT_STEP_BLKS;
+    while (budget > 0) {
+        if (compact_pos < compact_run.size()) {
+            // continue moving the run
+            BlkGuard blk_guard;
+            size_t end = min(compact_run.size(), compact_pos + budget);
+            for (size_t i = compact_pos; i < end; i++) move_to_compact_chunk(compact_run[i]);
+            budget -= end - compact_pos;
+            compact_pos = end;
+            continue;
+        }
+        compact_run.clear();
+        compact_pos = 0;
+        while (compact_next < blk_high and (blk_type[compact_next] != BLK_NODE or !blk_ids[compact_next])) compact_next++;
+        if (compact_next >= blk_high) {
+            BlkGuard blk_guard;
+            end_compact_pass();
+            return false;
+        }
+        Node node = get_node_by_blk_id(compact_next++);
+        if (node.node_type == NODE_DIR) trim_dir_content(node);
+        get_run(node, compact_run);
+
+        BlkGuard blk_guard;
+        budget -= min(budget, compact_run.size() / 8 + 1);
+        // a run that needs no move is dropped, the next node is measured next
+        if (!measure_run(compact_run)) compact_run.clear();
+    }
+    return true;
+}
+
+void* compactor(void* arg) {
+    while (true) {
+        if (compact_step()) usleep(COMPACT_STEP_DELAY);
+        else usleep(compact_interval * 1000);
+    }
+    return NULL;
+}
+
+void start_compactor() {
+    if (compact_interval == 0) return;
+    pthread_t thread;
+    pthread_create(&thread, NULL, compactor, NULL);
+    pthread_detach(thread);
+}
+
+void dump_compact_stats(FILE* f) {
+    if (compact_interval == 0) return;
+    FsGuard guard;
+    fprintf(f, "compact: fragmentation %.2f%% (last pass), %zu chunks, %zu blocks moved\n",
+            frag_ratio * 100, chunk_num, compact_moved);
+}
+
+/* compress functions */
+
+/*
+ * The compressor wakes up every ZIP_PERIOD seconds (at most zip_after / 4) and compresses
+ * resident data blocks untouched for zip_after seconds. It holds fs_lock for at most
+ * ZIP_STEP_BLKS compressions or ZIP_SCAN_BLKS examined blocks at a time.
+ */
+const uint32_t ZIP_PERIOD = 10;
+const size_t ZIP_STEP_BLKS = 64;
+const size_t ZIP_SCAN_BLKS = 4096;
+
+/*
+ * zip_blk
+ * compress a block into a slot and release its page, a block that doesn't compress
+ * well enough is marked blk_nozip and left as it is until it's written.
+ * blk_lock must be held if tiering is enabled.
+ */
+bool zip_blk(BLKID_T idx) {
+    static unsigned char buf[ZCLASS_SIZE * ZCLASS_NUM];
+    uint64_t begin = now_ns();
+    size_t len = lz_compress((unsigned char*)blk_ids[idx], PAGESIZE, buf, sizeof(buf));
+    zip_ns += now_ns() - begin;
+    if (!len) {
+        zip_rejects++;
+        blk_nozip[idx] = true;
+        return false;
+    }
+    unsigned char* slot = zalloc(len);
+    if (!slot) return false; // out of memory, tried again next time
+    memcpy(slot, buf, len);
+    unmap_blk(idx);
+    blk_zip[idx] = slot;
+    blk_zlen[idx] = len;
+    blk_state[idx] = BLK_COMPRESSED;
+    blk_unzips[idx] = 0;
+    tier_resident--;
+    zip_blocks++;
+    zip_bytes += len;
+    zip_count++;
+    return true;
+}
+
+void* compressor(void* arg) {
+    uint64_t start = now_ns();
+    uint32_t period = max((uint32_t)1, min(ZIP_PERIOD, zip_after / 4));
+    while (true) {
+        sleep(period);
+        coarse_now = (now_ns() - start) / 1000000000ull;
+        BLKID_T idx = 0;
+        while (idx < blk_high) {
+            FsGuard guard;
+            BlkGuard blk_guard;
+            size_t budget = ZIP_STEP_BLKS;
+            for (size_t n = 0; n < ZIP_SCAN_BLKS and idx < blk_high and budget > 0; n++, idx++) {
+                if (blk_type[idx] != BLK_DATA or blk_state[idx] != BLK_RESIDENT or !blk_ids[idx] or blk_nozip[idx]) continue;
+                if (coarse_now - blk_atime[idx] < zip_after) continue;
+                zip_blk(idx);
+                budget--;
+            }
+        }
+    }
+    return NULL;
+}
+
+void start_compressor() {
+    for (size_t i = 0; i < ZCACHE_SIZE; i++) zcache[i].idx = -1;
+    if (zip_after == 0) return;
+    pthread_t thread;
+    pthread_create(&thread, NULL, compressor, NULL);
+    pthread_detach(thread);
+}
+
+void dump_zip_stats(FILE* f) {
+    if (zip_after == 0) return;
+    FsGuard guard;
+    BlkGuard blk_guard;
+    fprintf(f, "compress: %zu blocks in %zu bytes (ratio %.2f), %zu bytes of slabs, %zu compressed, %zu rejected, %zu decompressed\n",
+            zip_blocks, zip_bytes, zip_bytes ? (double)zip_blocks * PAGESIZE / zip_bytes : 0,
+            zslab_bytes, zip_count, zip_rejects, unzip_count);
+    fprintf(f, "compress: cpu %.3f ms compressing, %.3f ms decompressing, cache hit rate %.2f%% (%zu/%zu)\n",
+            zip_ns / 1e6, unzip_ns / 1e6,
+            zcache_hits + zcache_misses ? zcache_hits * 100.0 / (zcache_hits + zcache_misses) : 0,
+            zcache_hits, zcache_hits + zcache_misses);
+}
+
+/* trace functions */
+
+/*
+ * A trace is a binary file: a TraceHeader followed by TraceRecords.
+ * Each TraceRecord is followed by `path_len` bytes of path (without '\0').
+ * It's written by the `trace_*` wrappers below when `--trace=FILE` is given,
+ * and read back by the replay tool (`--replay=FILE`).
+ */
+const char TRACE_MAGIC[8] = {'V', 'T', 'F', 'S', 'T', 'R', 'C', '1'};
+
+/*
+ * Every traced FUSE operation has a type.
+ */
+enum TRACEOP_T {
+    OP_GETATTR, OP_READDIR, OP_MKNOD, OP_MKDIR, OP_READ, OP_WRITE,
+    OP_TRUNCATE, OP_UNLINK, OP_RMDIR, OP_OPEN, OP_CREATE, OP_RELEASE, OP_NUM
+};
+
+const char* TRACEOP_NAMES[OP_NUM] = {
+    "getattr", "readdir", "mknod", "mkdir", "read", "write",
+    "truncate", "unlink", "rmdir", "open", "create", "release"
+};
+
+struct TraceHeader
+{
+    char magic[8];
+    uint64_t start_ns; // CLOCK_REALTIME when the trace began, for reference only
+};
+
+/*
+ * TraceRecord describes one finished operation.
+ * attributes:
+ *   timestamp: ns since the trace began, taken when the operation started;
+ *   latency: ns spent in the operation;
+ *   offset, size: arguments of read/write/truncate, 0 for others;
+ *   fh: the file handle of the operation, 0 if there's none;
+ *   ret: return value of the operation;
+ *   path_len: length of the path following the record;
+ *   op: see TRACEOP_T.
+ */
+struct TraceRecord
+{
+    uint64_t timestamp;
+    uint64_t latency;
+    int64_t offset;
+    uint64_t fh;
+    uint32_t size;
+    int32_t ret;
+    uint16_t path_len;
+    uint8_t op;
+    uint8_t reserved[5];
+};
+
+FILE* trace_file = NULL;
+uint64_t trace_epoch = 0;
+
+bool open_trace(const char* filename) {
+    trace_file = fopen(filename, "wb");
+    if (!trace_file) return false;
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    fwrite(&header, sizeof(header), 1, trace_file);
+    trace_epoch = now_ns();
+    return true;
+}
+
+void close_trace() {
+    if (trace_file) fclose(trace_file);
+    trace_file = NULL;
+}
+
+/*
+ * record_trace
+ * the record and its path are written by one fwrite, so records from
+ * concurrent FUSE threads never interleave.
+ */
+void record_trace(TRACEOP_T op, const char* path, off_t offset, size_t size, uint64_t fh, uint64_t begin, int ret) {
+    char buf[sizeof(TraceRecord) + PATH_MAX];
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    // FUSE passes a NULL path for an op on a handle whose file has no path any more
+    size_t path_len = path ? strnlen(path, PATH_MAX) : 0;
+    record.timestamp = begin - trace_epoch;
+    record.latency = now_ns() - begin;
+    record.offset = offset;
+    record.fh = fh;
+    record.size = size;
+    record.ret = ret;
+    record.path_len = path_len;
+    record.op = op;
+    memcpy(buf, &record, sizeof(record));
+    if (path_len) memcpy(buf + sizeof(record), path, path_len);
+    fwrite(buf, sizeof(record) + path_len, 1, trace_file);
 }
 
 /* fuse functions */
@@ -609,19 +1934,23 @@ static void *vtfs_init(struct fuse_conn_info *conn) {
     printf("[.] vtfs_init\n");
     NotExistsNode.node_id = -1;
     create_super_node();
+    start_tier();
+    start_compactor();
+    start_compressor();
     return NULL;
 }
 
 static int vtfs_getattr(const char *path, struct stat *stbuf)
 {
     printf("[.] vtfs_getattr path=%s\n", path);
+    FsGuard guard;
     int ret = 0;
     
     if(strcmp(path, "/") == 0) {
         memset(stbuf, 0, sizeof(struct stat));
         stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_uid = fuse_get_context()->uid;
-        stbuf->st_gid = fuse_get_context()->gid;
+        stbuf->st_uid = get_context()->uid;
+        stbuf->st_gid = get_context()->gid;
     } else {
         Node node = get_node_by_path(path + 1);
         if (node.node_id == -1) {
@@ -636,6 +1965,7 @@ static int vtfs_getattr(const char *path, struct stat *stbuf)
 static int vtfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
     printf("[.] vtfs_readdir path=%s\n", path);
+    FsGuard guard;
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     Node node = get_node_by_path(path + 1);
@@ -657,60 +1987,86 @@ static int vtfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off
 static int vtfs_mknod(const char *path, mode_t mode, dev_t dev)
 {
     printf("[.] vtfs_mknod\n");
+    FsGuard guard;
     struct stat st  = get_default_stat();
-    create_node_by_path(path + 1, &st);
-    return 0;
+    return create_node_by_path(path + 1, &st);
 }
 
 static int vtfs_mkdir(const char *path, mode_t mode)
 {
     printf("[.] vtfs_mkdir\n");
+    FsGuard guard;
     struct stat st = get_default_stat(true);
-    create_node_by_path(path + 1, &st, 0, NODE_DIR);
-    return 0;
+    return create_node_by_path(path + 1, &st, 0, NODE_DIR);
 }
 
 static int vtfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     printf("[.] vtfs_read\n");
-    Node node = get_node_by_path(path + 1);
+    FsGuard guard;
+    Node node = get_node_of_op(path, fi);
     if (node.node_id == -1)
         return -ENOENT;
     off_t ret = size;
     if(offset + size > node.st.st_size)
         ret = node.st.st_size - offset;
-    read_from_node(node, buf, offset, ret);
+    if (ret <= 0)
+        return 0;
+    FileHandle* fh = fi ? (FileHandle*)fi->fh : NULL;
+    if (!fh) return read_from_node(node, buf, offset, ret);
+    fh->streak = offset == fh->next_offset ? fh->streak + 1 : 0;
+    off_t err = read_from_node(node, buf, offset, ret, &fh->cursor);
+    if (err < 0) return err;
+    fh->next_offset = offset + ret;
+    if (fh->streak >= 2) readahead(node, fh);
     return ret;
 }
 
 static int vtfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     printf("[.] vtfs_write\n");
-    Node node = get_node_by_path(path + 1);
+    FsGuard guard;
+    Node node = get_node_of_op(path, fi);
     if (node.node_id == -1)
         return -ENOENT;
+    FileHandle* fh = fi ? (FileHandle*)fi->fh : NULL;
+    FileCursor* cursor = fh ? &fh->cursor : NULL;
     off_t new_size = node.st.st_size;
     if (offset + size > new_size) {
         new_size = offset + size;
     }
-    realloc_node_size(node, new_size);
-    write_to_node(node, buf, offset, size);
-    return size;
+    if (new_size != node.st.st_size and !realloc_node_size(node, new_size, cursor))
+        return -ENOSPC;
+    off_t written = write_to_node(node, buf, offset, size, cursor);
+    if (written < (off_t)size) {
+        // give back the part of the grown size that has no data
+        off_t end = max(node.st.st_size, offset + max(written, (off_t)0));
+        if (end < new_size) realloc_node_size(get_node_by_blk_id(node.blk_id), end, cursor);
+        if (written < 0) return written;
+    }
+    if (fh) {
+        fh->streak = offset == fh->next_offset ? fh->streak + 1 : 0;
+        fh->next_offset = offset + written;
+    }
+    return written;
 }
 
 static int vtfs_truncate(const char *path, off_t size)
 {
     printf("[.] vtfs_truncate\n");
+    FsGuard guard;
     Node node = get_node_by_path(path + 1);
     if (node.node_id == -1)
         return -ENOENT;
-    realloc_node_size(node, size);
+    if (!realloc_node_size(node, size))
+        return -ENOSPC;
     return 0;
 }
 
 static int vtfs_unlink(const char *path)
 {
     printf("[.] vtfs_unlink\n");
+    FsGuard guard;
     Node node = get_node_by_path(path + 1);
     if (node.node_id == -1)
         return -ENOENT;
@@ -721,6 +2077,7 @@ static int vtfs_unlink(const char *path)
 static int vtfs_rmdir(const char *path)
 {
     printf("[.] vtfs_rmdir\n");
+    FsGuard guard;
     Node node = get_node_by_path(path + 1);
     if (node.node_id == -1)
         return -ENOENT;
@@ -731,25 +2088,393 @@ static int vtfs_rmdir(const char *path)
 static int vtfs_open(const char *path, struct fuse_file_info *fi)
 {
     printf("[.] vtfs_open\n");
+    FsGuard guard;
+    Node node = get_node_by_path(path + 1);
+    if (node.node_id == -1)
+        return -ENOENT;
+    fi->fh = (uint64_t)open_handle(node);
+    return 0;
+}
+
+static int vtfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    printf("[.] vtfs_create\n");
+    FsGuard guard;
+    struct stat st = get_default_stat();
+    int ret = create_node_by_path(path + 1, &st);
+    if (ret) return ret;
+    fi->fh = (uint64_t)open_handle(get_node_by_path(path + 1));
+    return 0;
+}
+
+static int vtfs_release(const char *path, struct fuse_file_info *fi)
+{
+    printf("[.] vtfs_release\n");
+    FsGuard guard;
+    if (fi->fh) close_handle((FileHandle*)fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
+/*
+ * The stats of tiering, compaction and compression can be read at runtime
+ * from an extended attribute of the root: getfattr -n user.vtfs.stats <mountpoint>
+ */
+const char* STATS_XATTR = "user.vtfs.stats";
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+#ifdef __APPLE__
+static int vtfs_getxattr(const char *path, const char *name, char *value, size_t size, uint32_t position)
+#else
+static int vtfs_getxattr(const char *path, const char *name, char *value, size_t size)
+#endif
+{
+    printf("[.] vtfs_getxattr\n");
+    if (strcmp(path, "/") != 0 or strcmp(name, STATS_XATTR) != 0)
+        return -ENOATTR;
+    // the dump functions take their own locks
+    char* stats = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&stats, &len);
+    if (!f) return -ENOMEM;
+    dump_tier_stats(f);
+    dump_compact_stats(f);
+    dump_zip_stats(f);
+    fclose(f);
+    int ret = len;
+    if (size and len > size) ret = -ERANGE;
+    else if (size) memcpy(value, stats, len);
+    free(stats);
+    return ret;
+}
+
+static void vtfs_destroy(void *private_data)
+{
+    printf("[.] vtfs_destroy\n");
+    dump_tier_stats(stderr);
+    dump_compact_stats(stderr);
+    dump_zip_stats(stderr);
+    close_trace();
+}
+
+/* trace wrappers */
+
+/*
+ * trace_* wrappers are registered to FUSE instead of vtfs_*.
+ * They cost only a NULL check when tracing is off.
+ */
+static int trace_getattr(const char *path, struct stat *stbuf)
+{
+    if (!trace_file) return vtfs_getattr(path, stbuf);
+    uint64_t begin = now_ns();
+    int ret = vtfs_getattr(path, stbuf);
+    record_trace(OP_GETATTR, path, 0, 0, 0, begin, ret);
+    return ret;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    if (!trace_file) return vtfs_readdir(path, buf, filler, offset, fi);
+    uint64_t begin = now_ns();
+    int ret = vtfs_readdir(path, buf, filler, offset, fi);
+    record_trace(OP_READDIR, path, offset, 0, fi ? fi->fh : 0, begin, ret);
+    return ret;
+}
+
+static int trace_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    if (!trace_file) return vtfs_mknod(path, mode, dev);
+    uint64_t begin = now_ns();
+    int ret = vtfs_mknod(path, mode, dev);
+    record_trace(OP_MKNOD, path, 0, 0, 0, begin, ret);
+    return ret;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+    if (!trace_file) return vtfs_mkdir(path, mode);
+    uint64_t begin = now_ns();
+    int ret = vtfs_mkdir(path, mode);
+    record_trace(OP_MKDIR, path, 0, 0, 0, begin, ret);
+    return ret;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    if (!trace_file) return vtfs_read(path, buf, size, offset, fi);
+    uint64_t begin = now_ns();
+    int ret = vtfs_read(path, buf, size, offset, fi);
+    record_trace(OP_READ, path, offset, size, fi ? fi->fh : 0, begin, ret);
+    return ret;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    if (!trace_file) return vtfs_write(path, buf, size, offset, fi);
+    uint64_t begin = now_ns();
+    int ret = vtfs_write(path, buf, size, offset, fi);
+    record_trace(OP_WRITE, path, offset, size, fi ? fi->fh : 0, begin, ret);
+    return ret;
+}
+
+static int trace_truncate(const char *path, off_t size)
+{
+    if (!trace_file) return vtfs_truncate(path, size);
+    uint64_t begin = now_ns();
+    int ret = vtfs_truncate(path, size);
+    record_trace(OP_TRUNCATE, path, size, 0, 0, begin, ret);
+    return ret;
+}
+
+static int trace_unlink(const char *path)
+{
+    if (!trace_file) return vtfs_unlink(path);
+    uint64_t begin = now_ns();
+    int ret = vtfs_unlink(path);
+    record_trace(OP_UNLINK, path, 0, 0, 0, begin, ret);
+    return ret;
+}
+
+static int trace_rmdir(const char *path)
+{
+    if (!trace_file) return vtfs_rmdir(path);
+    uint64_t begin = now_ns();
+    int ret = vtfs_rmdir(path);
+    record_trace(OP_RMDIR, path, 0, 0, 0, begin, ret);
+    return ret;
+}
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+    if (!trace_file) return vtfs_open(path, fi);
+    uint64_t begin = now_ns();
+    int ret = vtfs_open(path, fi);
+    record_trace(OP_OPEN, path, 0, 0, fi ? fi->fh : 0, begin, ret);
+    return ret;
+}
+
+static int trace_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    if (!trace_file) return vtfs_create(path, mode, fi);
+    uint64_t begin = now_ns();
+    int ret = vtfs_create(path, mode, fi);
+    record_trace(OP_CREATE, path, 0, 0, fi->fh, begin, ret);
+    return ret;
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+    if (!trace_file) return vtfs_release(path, fi);
+    uint64_t fh = fi->fh;
+    uint64_t begin = now_ns();
+    int ret = vtfs_release(path, fi);
+    record_trace(OP_RELEASE, path, 0, 0, fh, begin, ret);
+    return ret;
+}
+
+/* replay functions */
+
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    return 0;
+}
+
+/*
+ * replay_record
+ * call the vtfs_* function of a record directly, without FUSE.
+ * `handles` maps the traced file handles to the handles of the replay.
+ */
+int replay_record(const TraceRecord& record, const char* path, vector<char>& buf, map<uint64_t, uint64_t>& handles) {
+    struct stat st;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    if (record.fh and handles.count(record.fh)) fi.fh = handles[record.fh];
+    if (buf.size() < record.size) buf.resize(record.size, 'x');
+    // only the ops on a handle can come without a path
+    if (!path and record.op != OP_READ and record.op != OP_WRITE and record.op != OP_RELEASE) return -ENOENT;
+    int ret = -EINVAL;
+    switch (record.op) {
+        case OP_GETATTR:  return vtfs_getattr(path, &st);
+        case OP_READDIR:  return vtfs_readdir(path, NULL, replay_filler, record.offset, &fi);
+        case OP_MKNOD:    return vtfs_mknod(path, S_IFREG | 0755, 0);
+        case OP_MKDIR:    return vtfs_mkdir(path, 0755);
+        case OP_READ:     return vtfs_read(path, &buf[0], record.size, record.offset, &fi);
+        case OP_WRITE:    return vtfs_write(path, &buf[0], record.size, record.offset, &fi);
+        case OP_TRUNCATE: return vtfs_truncate(path, record.offset);
+        case OP_UNLINK:   return vtfs_unlink(path);
+        case OP_RMDIR:    return vtfs_rmdir(path);
+        case OP_OPEN:
+        case OP_CREATE:
+            ret = record.op == OP_OPEN ? vtfs_open(path, &fi) : vtfs_create(path, S_IFREG | 0755, &fi);
+            if (ret == 0 and record.fh) handles[record.fh] = fi.fh;
+            return ret;
+        case OP_RELEASE:
+            ret = vtfs_release(path, &fi);
+            handles.erase(record.fh);
+            return ret;
+    }
+    return ret;
+}
+
+/*
+ * replay_trace
+ * drive the engine in-process from a trace, and report per-op latency on stderr.
+ * If `fast` is false, records are issued at their recorded timestamps,
+ * otherwise they are issued as fast as possible.
+ */
+int replay_trace(const char* filename, bool fast) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "vtfs: cannot open trace %s\n", filename);
+        return 1;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 or memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        fprintf(stderr, "vtfs: %s is not a vtfs trace\n", filename);
+        fclose(f);
+        return 1;
+    }
+
+    replaying = true;
+    vtfs_init(NULL);
+
+    vector<uint64_t> latency[OP_NUM];
+    uint64_t recorded[OP_NUM];
+    memset(recorded, 0, sizeof(recorded));
+    size_t mismatch = 0;
+    vector<char> buf;
+    map<uint64_t, uint64_t> handles;
+    char path[PATH_MAX + 1];
+    TraceRecord record;
+    uint64_t start = now_ns();
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        if (record.op >= OP_NUM or record.path_len > PATH_MAX or fread(path, 1, record.path_len, f) != record.path_len) {
+            fprintf(stderr, "vtfs: truncated or corrupted trace\n");
+            break;
+        }
+        path[record.path_len] = '\0';
+        if (!fast) {
+            uint64_t due = start + record.timestamp;
+            uint64_t now = now_ns();
+            if (due > now) {
+                struct timespec ts;
+                ts.tv_sec = (due - now) / 1000000000ull;
+                ts.tv_nsec = (due - now) % 1000000000ull;
+                nanosleep(&ts, NULL);
+            }
+        }
+        uint64_t begin = now_ns();
+        int ret = replay_record(record, record.path_len ? path : NULL, buf, handles);
+        latency[record.op].push_back(now_ns() - begin);
+        recorded[record.op] += record.latency;
+        if (ret != record.ret) mismatch++;
+    }
+    fclose(f);
+
+    fprintf(stderr, "%-10s %10s %12s %12s %12s %12s %12s\n",
+            "op", "count", "avg(us)", "p50(us)", "p99(us)", "max(us)", "traced(us)");
+    for (int op = 0; op < OP_NUM; op++) {
+        vector<uint64_t>& lat = latency[op];
+        if (lat.empty()) continue;
+        sort(lat.begin(), lat.end());
+        uint64_t total = 0;
+        for (size_t i = 0; i < lat.size(); i++) total += lat[i];
+        fprintf(stderr, "%-10s %10zu %12.2f %12.2f %12.2f %12.2f %12.2f\n",
+                TRACEOP_NAMES[op], lat.size(),
+                total / 1e3 / lat.size(),
+                lat[lat.size() / 2] / 1e3,
+                lat[lat.size() * 99 / 100] / 1e3,
+                lat.back() / 1e3,
+                recorded[op] / 1e3 / lat.size());
+    }
+    fprintf(stderr, "total: %.3f s, %zu return value mismatch(es)\n", (now_ns() - start) / 1e9, mismatch);
+    dump_tier_stats(stderr);
+    dump_compact_stats(stderr);
+    dump_zip_stats(stderr);
     return 0;
 }
 
 /* main */
 
+/*
+ * Options handled by vtfs itself (everything else goes to FUSE):
+ *   --trace=FILE   record every operation to FILE;
+ *   --replay=FILE  replay FILE in-process instead of mounting;
+ *   --replay-fast  issue replayed operations as fast as possible;
+ *   --mem-budget=MB      keep at most MB of file data in memory,
+ *   --backing-file=FILE  spill the rest to FILE (both are needed to enable tiering);
+ *   --compact-interval=MS  wait MS between compaction passes, 0 disables the compactor;
+ *   --compress-after=SEC   compress data blocks untouched for SEC seconds.
+ */
 int main(int argc, char *argv[])
 {
+    const char* replay_filename = NULL;
+    bool replay_fast = false;
+    const char* backing_filename = NULL;
+    size_t mem_budget = 0;
+    int fuse_argc = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            if (!open_trace(argv[i] + 8)) {
+                fprintf(stderr, "vtfs: cannot open trace %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replay_filename = argv[i] + 9;
+        } else if (strcmp(argv[i], "--replay-fast") == 0) {
+            replay_fast = true;
+        } else if (strncmp(argv[i], "--mem-budget=", 13) == 0) {
+            mem_budget = strtoull(argv[i] + 13, NULL, 10);
+        } else if (strncmp(argv[i], "--backing-file=", 15) == 0) {
+            backing_filename = argv[i] + 15;
+        } else if (strncmp(argv[i], "--compact-interval=", 19) == 0) {
+            compact_interval = strtoull(argv[i] + 19, NULL, 10);
+        } else if (strncmp(argv[i], "--compress-after=", 17) == 0) {
+            zip_after = strtoul(argv[i] + 17, NULL, 10);
+        } else {
+            argv[fuse_argc++] = argv[i];
+        }
+    }
+    argc = fuse_argc;
+
+    if (backing_filename or mem_budget) {
+        if (!backing_filename or !mem_budget) {
+            fprintf(stderr, "vtfs: --mem-budget and --backing-file must be given together\n");
+            return 1;
+        }
+        if (!open_tier(backing_filename, mem_budget)) {
+            fprintf(stderr, "vtfs: cannot open backing file %s\n", backing_filename);
+            return 1;
+        }
+    }
+
+    if (replay_filename) return replay_trace(replay_filename, replay_fast);
+
     struct fuse_operations op;
     memset(&op, 0, sizeof(op));
     op.init = vtfs_init;
-    op.getattr = vtfs_getattr;
-    op.readdir = vtfs_readdir;
-    op.mknod = vtfs_mknod;
-    op.open = vtfs_open;
-    op.write = vtfs_write;
-    op.truncate = vtfs_truncate;
-    op.read = vtfs_read;
-    op.unlink = vtfs_unlink;
-    op.rmdir = vtfs_rmdir;
-    op.mkdir = vtfs_mkdir;
-    return fuse_main(argc, argv, &op, NULL);
+    op.destroy = vtfs_destroy;
+    op.getattr = trace_getattr;
+    op.readdir = trace_readdir;
+    op.mknod = trace_mknod;
+    op.open = trace_open;
+    op.create = trace_create;
+    op.release = trace_release;
+    op.write = trace_write;
+    op.truncate = trace_truncate;
+    op.read = trace_read;
+    op.unlink = trace_unlink;
+    op.rmdir = trace_rmdir;
+    op.mkdir = trace_mkdir;
+    op.getxattr = vtfs_getxattr;
+    // an unlinked file is kept until its last handle is released (see remove_node),
+    // so FUSE needn't rename it to .fuse_hidden*, which vtfs can't do
+    vector<char*> fuse_argv(argv, argv + argc);
+    fuse_argv.push_back((char*)"-o");
+    fuse_argv.push_back((char*)"hard_remove");
+    fuse_argv.push_back(NULL);
+    return fuse_main((int)fuse_argv.size() - 1, &fuse_argv[0], &op, NULL);
 }